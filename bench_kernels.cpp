@@ -0,0 +1,98 @@
+/*
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+// Times the fixed-size projection kernels against sgemm for every specialized (D, L) and
+// small batch sizes, and prints the range of batch sizes for which the kernel is faster.
+// project_kernel_rows (kernels.hpp) only keeps the shapes where the margin is clear.
+// Run it with OMP_NUM_THREADS and OPENBLAS_NUM_THREADS set as in production.
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <pca.hpp>
+
+using namespace std;
+
+// Time of one call, in microseconds
+template<typename F>
+double time_us (F f)
+{
+  chrono::steady_clock::time_point start = chrono::steady_clock::now ();
+  f ();
+  return chrono::duration<double, micro> (chrono::steady_clock::now () - start).count ();
+}
+
+int main (int argc, char * argv[])
+{
+  const size_t Ds[] = {128, 256, 512, 4096};
+  const size_t Ls[] = {32, 64, 128, 256};
+  const size_t Ns[] = {1, 2, 4, 8, 16, 32, 64};
+  mt19937 rng (0);
+  uniform_real_distribution<float> uniform (-1.0f, 1.0f);
+
+  cout << "cpu level " << cpu_level () << endl;
+  cout << "    D    L    N   kernel(us)    sgemm(us)" << endl;
+  for (size_t D : Ds)
+    for (size_t L : Ls)
+      {
+        project_rows_fn kernel = select_project_rows (D, L);
+        if (kernel == nullptr)
+          {
+            cout << "no kernel for this CPU" << endl;
+            return 0;
+          }
+        // Longest run of consecutive batch sizes where the kernel wins
+        size_t min_rows = 0, max_rows = 0, first = 0;
+        vector<float> pc (D * L), mean (D), inv (D, 1.0f), data (64 * D), tmp (64 * D), out (64 * L);
+        for (float &v : pc) v = uniform (rng);
+        for (float &v : mean) v = uniform (rng);
+        for (float &v : data) v = uniform (rng);
+        for (size_t N : Ns)
+          {
+            int repeat = D * L * N > (1 << 24) ? 50 : 500;
+            // Best of interleaved runs, so that both sides see the same machine state
+            double t_kernel = 1e30, t_sgemm = 1e30;
+            for (int r = 0; r < repeat; ++r)
+              {
+                t_kernel = min (t_kernel, time_us ([&] ()
+                                                   {
+                                                     kernel (data.data (), out.data (), pc.data (), mean.data (), inv.data (), N);
+                                                   }));
+                // The sgemm path of project(): normalize the rows, then multiply
+                t_sgemm = min (t_sgemm, time_us ([&] ()
+                                                 {
+                                                   for (size_t i = 0; i < N; ++i)
+                                                     for (size_t j = 0; j < D; ++j)
+                                                       tmp[i * D + j] = (data[i * D + j] - mean[j]) * inv[j];
+                                                   cblas_sgemm (CblasRowMajor, CblasNoTrans, CblasNoTrans, N, L, D,
+                                                                1.0f, tmp.data (), D, pc.data (), L, 0.0f, out.data (), L);
+                                                 }));
+              }
+            cout << setw (5) << D << setw (5) << L << setw (5) << N << fixed << setprecision (1)
+                 << setw (13) << t_kernel << setw (13) << t_sgemm << endl;
+            if (t_kernel >= t_sgemm)
+              first = 0;
+            else
+              {
+                if (first == 0)
+                  first = N;
+                if (max_rows == 0 || N / first > max_rows / min_rows)
+                  {
+                    min_rows = first;
+                    max_rows = N;
+                  }
+              }
+          }
+        cout << "D=" << D << " L=" << L << ": kernel faster for N in [" << min_rows << ", " << max_rows << "]" << endl;
+      }
+  return 0;
+}
@@ -0,0 +1,257 @@
+/*
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVALUATION_DEEPLOCALDESC_CACHE_HPP
+#define EVALUATION_DEEPLOCALDESC_CACHE_HPP
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// On-disk cache of extraction results, keyed by the content of the input.
+// A cache directory holds two append-only files:
+//   segments.bin: the cached blobs, each one prefixed by its key and length
+//   index.bin:    one cache_entry per blob, appended after the blob is written
+// Both files are memory-mapped for lookups and the newest entry of a key wins.
+
+struct cache_entry
+{
+  uint64_t key;
+  uint64_t offset; // offset of the blob data in segments.bin
+  uint64_t length;
+};
+
+inline uint64_t hash_bytes (
+    const unsigned char *bytes,
+    size_t size,
+    uint64_t h = 14695981039346656037ULL)
+{
+  // 64-bit FNV-1a
+  size_t i;
+  for (i = 0; i < size; i++)
+    {
+      h ^= bytes[i];
+      h *= 1099511628211ULL;
+    }
+  return h;
+}
+
+inline bool hash_file (
+    const std::string &fName,
+    uint64_t &h)
+{
+  int fd = open (fName.c_str (), O_RDONLY);
+  if (fd < 0)
+    {
+      return false;
+    }
+  struct stat st;
+  if (fstat (fd, &st) != 0)
+    {
+      close (fd);
+      return false;
+    }
+  size_t size = st.st_size;
+  h = hash_bytes (nullptr, 0);
+  if (size > 0)
+    {
+      unsigned char *mapped = (unsigned char *) mmap (0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapped == MAP_FAILED)
+        {
+          close (fd);
+          return false;
+        }
+      h = hash_bytes (mapped, size, h);
+      munmap (mapped, size);
+    }
+  close (fd);
+  return true;
+}
+
+inline bool cache_lookup (
+    const std::string &dir,
+    uint64_t key,
+    std::vector<unsigned char> &blob)
+{
+  std::string index_name = dir + "/index.bin";
+  std::string segment_name = dir + "/segments.bin";
+  int fd = open (index_name.c_str (), O_RDONLY);
+  if (fd < 0)
+    {
+      return false;
+    }
+  struct stat st;
+  if (fstat (fd, &st) != 0 || st.st_size < (off_t) sizeof (cache_entry))
+    {
+      close (fd);
+      return false;
+    }
+  size_t size = st.st_size;
+  unsigned char *mapped = (unsigned char *) mmap (0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (mapped == MAP_FAILED)
+    {
+      return false;
+    }
+
+  // Scan backwards so that the newest entry of the key is used
+  bool found = false;
+  cache_entry entry;
+  size_t n = size / sizeof (cache_entry);
+  while (n-- > 0)
+    {
+      memcpy (&entry, mapped + n * sizeof (cache_entry), sizeof (cache_entry));
+      if (entry.key == key)
+        {
+          found = true;
+          break;
+        }
+    }
+  munmap (mapped, size);
+  if (!found)
+    {
+      return false;
+    }
+
+  fd = open (segment_name.c_str (), O_RDONLY);
+  if (fd < 0)
+    {
+      return false;
+    }
+  uint64_t header[2];
+  if (fstat (fd, &st) != 0 || entry.offset < sizeof (header)
+      || (uint64_t) st.st_size < entry.offset + entry.length)
+    {
+      close (fd);
+      return false;
+    }
+  size = st.st_size;
+  mapped = (unsigned char *) mmap (0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (mapped == MAP_FAILED)
+    {
+      return false;
+    }
+  // The record header must repeat the key and length of the index entry, otherwise the entry
+  // is stale or points into another record: treat it as a miss
+  memcpy (header, mapped + entry.offset - sizeof (header), sizeof (header));
+  if (header[0] != entry.key || header[1] != entry.length)
+    {
+      munmap (mapped, size);
+      return false;
+    }
+  blob.assign (mapped + entry.offset, mapped + entry.offset + entry.length);
+  munmap (mapped, size);
+  return true;
+}
+
+inline bool write_all (
+    int fd,
+    const unsigned char *bytes,
+    size_t size)
+{
+  while (size > 0)
+    {
+      ssize_t status = write (fd, bytes, size);
+      if (status <= 0)
+        {
+          return false;
+        }
+      bytes += status;
+      size -= status;
+    }
+  return true;
+}
+
+inline bool cache_append (
+    const std::string &dir,
+    uint64_t key,
+    const std::vector<unsigned char> &blob)
+{
+  std::string index_name = dir + "/index.bin";
+  std::string segment_name = dir + "/segments.bin";
+  mkdir (dir.c_str (), (mode_t) 0700);
+
+  int fd = open (segment_name.c_str (), O_WRONLY | O_CREAT | O_APPEND, (mode_t) 0600);
+  if (fd < 0)
+    {
+      return false;
+    }
+  // Several processes may share the cache: the segment file is locked for the whole append,
+  // index update included, so that records do not interleave and the offset stays valid.
+  if (flock (fd, LOCK_EX) != 0)
+    {
+      close (fd);
+      return false;
+    }
+  cache_entry entry;
+  entry.key = key;
+  entry.length = blob.size ();
+  off_t start = lseek (fd, 0, SEEK_END);
+  if (start == -1)
+    {
+      close (fd);
+      return false;
+    }
+  uint64_t header[2] = {entry.key, entry.length};
+  entry.offset = start + sizeof (header);
+
+  // Write the record header and the blob together, then finish a short write if any
+  struct iovec iov[2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = sizeof (header);
+  iov[1].iov_base = (void *) blob.data ();
+  iov[1].iov_len = blob.size ();
+  ssize_t status = writev (fd, iov, 2);
+  bool ok = status >= 0;
+  if (ok && (size_t) status < sizeof (header))
+    {
+      ok = write_all (fd, (const unsigned char *) header + status, sizeof (header) - status)
+           && write_all (fd, blob.data (), blob.size ());
+    }
+  else if (ok && (size_t) status < sizeof (header) + blob.size ())
+    {
+      size_t done = status - sizeof (header);
+      ok = write_all (fd, blob.data () + done, blob.size () - done);
+    }
+  if (!ok)
+    {
+      close (fd);
+      return false;
+    }
+  // The blob must be on disk before the index points to it
+  fsync (fd);
+
+  int index_fd = open (index_name.c_str (), O_WRONLY | O_CREAT | O_APPEND, (mode_t) 0600);
+  if (index_fd < 0)
+    {
+      close (fd);
+      return false;
+    }
+  ok = write_all (index_fd, (const unsigned char *) &entry, sizeof (cache_entry));
+  close (index_fd);
+  // Closing the segment file releases the lock
+  close (fd);
+  return ok;
+}
+
+#endif //EVALUATION_DEEPLOCALDESC_CACHE_HPP
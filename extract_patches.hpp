@@ -27,7 +27,11 @@
 #include <opencv2/features2d.hpp>
 // Only support OpenCV 3.x!
 #include <opencv2/xfeatures2d.hpp>
+#include <cache.hpp>
 #include <fstream>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -37,11 +41,118 @@
 #include <omp.h>
 #endif
 
+/**
+ * Suppress keypoints which fall within the given tolerance of a stronger one.
+ * DoG-SIFT returns one keypoint per dominant orientation, and since the patches
+ * are cropped unrotated with a fixed radius those keypoints give identical patches.
+ * Keypoints are hashed into a grid of (x, y, log2(size)) cells; the strongest
+ * keypoint of each neighbourhood is kept and the others are recorded in `groups`.
+ * A negative position tolerance disables the suppression.
+ */
+inline void suppress_duplicate_keypoints (
+    std::vector<cv::KeyPoint> &keypoints,
+    std::vector<std::vector<int> > &groups, // groups[k] lists the original indices merged into the k-th kept keypoint
+    const float &pos_tolerance,
+    const float &scale_tolerance
+)
+{
+  size_t n = keypoints.size ();
+  size_t i, k;
+  groups.clear ();
+  if (pos_tolerance < 0.0f)
+    {
+      groups.resize (n);
+      for (i = 0; i < n; i++)
+        groups[i].push_back (i);
+      return;
+    }
+
+  // Visit the keypoints by decreasing response so that the strongest one of a group survives
+  std::vector<int> order (n);
+  for (i = 0; i < n; i++)
+    order[i] = i;
+  std::stable_sort (order.begin (), order.end (), [&keypoints] (int a, int b)
+  {
+    return keypoints[a].response > keypoints[b].response;
+  });
+
+  float cell_pos = pos_tolerance > 0.0f ? pos_tolerance : 1.0f;
+  float cell_scale = scale_tolerance > 0.0f ? scale_tolerance : 1.0f;
+  std::unordered_map<uint64_t, std::vector<int> > grid; // cell -> kept keypoints
+  std::vector<int> owner (n, -1); // kept keypoint absorbing each suppressed one
+  for (i = 0; i < n; i++)
+    {
+      const cv::KeyPoint &kp = keypoints[order[i]];
+      float ls = std::log2 (std::max (kp.size, 1e-6f));
+      int64_t cx = (int64_t) std::floor (kp.pt.x / cell_pos);
+      int64_t cy = (int64_t) std::floor (kp.pt.y / cell_pos);
+      int64_t cs = (int64_t) std::floor (ls / cell_scale);
+
+      int found = -1;
+      for (int dx = -1; dx <= 1 && found < 0; dx++)
+        for (int dy = -1; dy <= 1 && found < 0; dy++)
+          for (int ds = -1; ds <= 1 && found < 0; ds++)
+            {
+              uint64_t key = ((uint64_t) (cx + dx) & 0x1FFFFF) << 42
+                             | ((uint64_t) (cy + dy) & 0x1FFFFF) << 21
+                             | ((uint64_t) (cs + ds) & 0x1FFFFF);
+              std::unordered_map<uint64_t, std::vector<int> >::const_iterator it = grid.find (key);
+              if (it == grid.end ())
+                continue;
+              for (k = 0; k < it->second.size (); k++)
+                {
+                  const cv::KeyPoint &ref = keypoints[it->second[k]];
+                  if (std::fabs (ref.pt.x - kp.pt.x) <= pos_tolerance
+                      && std::fabs (ref.pt.y - kp.pt.y) <= pos_tolerance
+                      && std::fabs (std::log2 (std::max (ref.size, 1e-6f)) - ls) <= scale_tolerance)
+                    {
+                      found = it->second[k];
+                      break;
+                    }
+                }
+            }
+
+      if (found >= 0)
+        {
+          owner[order[i]] = found;
+        }
+      else
+        {
+          uint64_t key = ((uint64_t) cx & 0x1FFFFF) << 42
+                         | ((uint64_t) cy & 0x1FFFFF) << 21
+                         | ((uint64_t) cs & 0x1FFFFF);
+          grid[key].push_back (order[i]);
+          owner[order[i]] = order[i];
+        }
+    }
+
+  // Keep the surviving keypoints in detection order
+  std::vector<int> slot (n, -1);
+  std::vector<cv::KeyPoint> kept;
+  for (i = 0; i < n; i++)
+    {
+      if (owner[i] == (int) i)
+        {
+          slot[i] = kept.size ();
+          kept.push_back (keypoints[i]);
+          groups.push_back (std::vector<int> ());
+        }
+    }
+  for (i = 0; i < n; i++)
+    groups[slot[owner[i]]].push_back (i);
+  keypoints.swap (kept);
+}
+
 inline bool extract_patches (
     const std::string &filename,
     std::vector<cv::Mat> &patches, // patches will be stored here
+    std::vector<std::vector<int> > &duplicates, // keypoints merged into each patch, as indices into detections
+    std::vector<cv::KeyPoint> &geometry, // keypoint of each patch
+    std::vector<cv::KeyPoint> &detections, // every detected keypoint, in detection order
     const int &radius,
-    int &nframes
+    int &nframes,
+    const float &pos_tolerance,
+    const float &scale_tolerance
 )
 {
   try
@@ -53,13 +164,16 @@ inline bool extract_patches (
       std::vector<cv::KeyPoint> keypoints;
       cv::Ptr<cv::Feature2D> feature2d = cv::xfeatures2d::SIFT::create (); // Extract all keypoints with DoG-Lowe's SIFT
       feature2d->detect (img_gray, keypoints);
-
-      // Restore data in array format
       nframes = keypoints.size ();
+      detections = keypoints;
 
+      // Drop the keypoints which would give the same patch
+      suppress_duplicate_keypoints (keypoints, duplicates, pos_tolerance, scale_tolerance);
+
+      // Restore data in array format
       int i;
       int st_x, st_y, ed_x, ed_y;
-      for (i = 0; i < nframes; i++)
+      for (i = 0; i < (int) keypoints.size (); i++)
         {
           st_x = (keypoints[i].pt.x - radius >= 0) ? (keypoints[i].pt.x - radius) : 0;
           st_y = (keypoints[i].pt.y - radius >= 0) ? (keypoints[i].pt.y - radius) : 0;
@@ -71,6 +185,7 @@ inline bool extract_patches (
       // Clean up
       img.release ();
       img_gray.release ();
+      geometry.swap (keypoints);
       keypoints.clear ();
       feature2d->clear ();
     }
@@ -90,4 +205,208 @@ inline bool extract_patches (
   return true;
 }
 
+// Keypoint geometry is saved as KEYPOINT_FIELDS floats per patch: x, y, size, angle, response
+#define KEYPOINT_FIELDS 5
+
+inline void keypoints_to_floats (
+    const std::vector<cv::KeyPoint> &keypoints,
+    std::vector<float> &values)
+{
+  size_t i;
+  values.resize (keypoints.size () * KEYPOINT_FIELDS);
+  for (i = 0; i < keypoints.size (); i++)
+    {
+      values[i * KEYPOINT_FIELDS] = keypoints[i].pt.x;
+      values[i * KEYPOINT_FIELDS + 1] = keypoints[i].pt.y;
+      values[i * KEYPOINT_FIELDS + 2] = keypoints[i].size;
+      values[i * KEYPOINT_FIELDS + 3] = keypoints[i].angle;
+      values[i * KEYPOINT_FIELDS + 4] = keypoints[i].response;
+    }
+}
+
+// Bump when the extraction or the blob layout below changes, to invalidate old cache entries
+#define EXTRACT_PATCHES_CACHE_VERSION 3
+
+template<typename T>
+inline void blob_put (
+    std::vector<unsigned char> &blob,
+    const T &value)
+{
+  const unsigned char *p = (const unsigned char *) &value;
+  blob.insert (blob.end (), p, p + sizeof (T));
+}
+
+template<typename T>
+inline bool blob_get (
+    const std::vector<unsigned char> &blob,
+    size_t &base,
+    T &value)
+{
+  if (base + sizeof (T) > blob.size ())
+    {
+      return false;
+    }
+  memcpy (&value, &blob[base], sizeof (T));
+  base += sizeof (T);
+  return true;
+}
+
+inline void serialize_patches (
+    std::vector<unsigned char> &blob,
+    const std::vector<cv::Mat> &patches,
+    const std::vector<std::vector<int> > &duplicates,
+    const std::vector<cv::KeyPoint> &geometry,
+    const std::vector<cv::KeyPoint> &detections,
+    int nframes)
+{
+  size_t i, j;
+  blob.clear ();
+  // nframes detections first, so that the group indices can be checked against them
+  blob_put (blob, (int32_t) nframes);
+  for (i = 0; i < detections.size (); i++)
+    blob_put (blob, detections[i]);
+  blob_put (blob, (int32_t) patches.size ());
+  for (i = 0; i < patches.size (); i++)
+    {
+      cv::Mat patch = patches[i].isContinuous () ? patches[i] : patches[i].clone ();
+      blob_put (blob, (int32_t) patch.rows);
+      blob_put (blob, (int32_t) patch.cols);
+      blob_put (blob, (int32_t) patch.type ());
+      blob.insert (blob.end (), patch.data, patch.data + patch.total () * patch.elemSize ());
+      blob_put (blob, (int32_t) duplicates[i].size ());
+      for (j = 0; j < duplicates[i].size (); j++)
+        blob_put (blob, (int32_t) duplicates[i][j]);
+      blob_put (blob, geometry[i]);
+    }
+}
+
+inline bool deserialize_patches (
+    const std::vector<unsigned char> &blob,
+    std::vector<cv::Mat> &patches,
+    std::vector<std::vector<int> > &duplicates,
+    std::vector<cv::KeyPoint> &geometry,
+    std::vector<cv::KeyPoint> &detections,
+    int &nframes)
+{
+  size_t base = 0;
+  int32_t i, j, count, rows, cols, type, ngroup, value;
+  if (!blob_get (blob, base, value) || value < 0
+      || (size_t) value * sizeof (cv::KeyPoint) > blob.size () - base)
+    {
+      return false;
+    }
+  nframes = value;
+  detections.resize (nframes);
+  for (i = 0; i < nframes; i++)
+    blob_get (blob, base, detections[i]);
+  if (!blob_get (blob, base, count))
+    {
+      return false;
+    }
+  for (i = 0; i < count; i++)
+    {
+      if (!blob_get (blob, base, rows) || !blob_get (blob, base, cols) || !blob_get (blob, base, type))
+        {
+          return false;
+        }
+      // Check the fields before allocating, a corrupt entry must not reach cv::Mat
+      if (rows < 0 || cols < 0 || type != (type & CV_MAT_TYPE_MASK))
+        {
+          return false;
+        }
+      size_t bytes = (size_t) rows * cols * CV_ELEM_SIZE (type);
+      if (bytes > blob.size () - base)
+        {
+          return false;
+        }
+      cv::Mat patch (rows, cols, type);
+      memcpy (patch.data, &blob[base], bytes);
+      base += bytes;
+      patches.push_back (patch);
+
+      if (!blob_get (blob, base, ngroup) || ngroup < 0
+          || (size_t) ngroup * sizeof (int32_t) > blob.size () - base)
+        {
+          return false;
+        }
+      duplicates.push_back (std::vector<int> ());
+      for (j = 0; j < ngroup; j++)
+        {
+          if (!blob_get (blob, base, value) || value < 0 || value >= nframes)
+            {
+              return false;
+            }
+          duplicates.back ().push_back (value);
+        }
+      cv::KeyPoint keypoint;
+      if (!blob_get (blob, base, keypoint))
+        {
+          return false;
+        }
+      geometry.push_back (keypoint);
+    }
+  return true;
+}
+
+// Same as extract_patches, but the result is looked up first in the cache directory,
+// keyed by the image bytes and the extraction parameters. An empty cache_dir disables the cache.
+inline bool extract_patches_cached (
+    const std::string &cache_dir,
+    const std::string &filename,
+    std::vector<cv::Mat> &patches,
+    std::vector<std::vector<int> > &duplicates,
+    std::vector<cv::KeyPoint> &geometry,
+    std::vector<cv::KeyPoint> &detections,
+    const int &radius,
+    int &nframes,
+    const float &pos_tolerance,
+    const float &scale_tolerance,
+    bool &hit
+)
+{
+  hit = false;
+  uint64_t key;
+  if (cache_dir.empty () || !hash_file (filename, key))
+    {
+      return extract_patches (filename, patches, duplicates, geometry, detections, radius, nframes, pos_tolerance, scale_tolerance);
+    }
+  std::vector<unsigned char> blob;
+  blob_put (blob, (int32_t) EXTRACT_PATCHES_CACHE_VERSION);
+  blob_put (blob, (int32_t) radius);
+  blob_put (blob, pos_tolerance);
+  blob_put (blob, scale_tolerance);
+  key = hash_bytes (blob.data (), blob.size (), key);
+
+  if (cache_lookup (cache_dir, key, blob))
+    {
+      bool valid;
+      try
+        {
+          valid = deserialize_patches (blob, patches, duplicates, geometry, detections, nframes);
+        }
+      catch (...)
+        {
+          valid = false;
+        }
+      if (valid)
+        {
+          hit = true;
+          return true;
+        }
+      // A damaged entry: extract again, the new entry will supersede it
+      patches.clear ();
+      duplicates.clear ();
+      geometry.clear ();
+      detections.clear ();
+    }
+
+  if (!extract_patches (filename, patches, duplicates, geometry, detections, radius, nframes, pos_tolerance, scale_tolerance))
+    {
+      return false;
+    }
+  serialize_patches (blob, patches, duplicates, geometry, detections, nframes);
+  cache_append (cache_dir, key, blob);
+  return true;
+}
+
 #endif //EVALUATION_DEEPLOCALDESC_EXTRACT_PATCHES_HPP
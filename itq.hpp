@@ -0,0 +1,459 @@
+/*
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVALUATION_DEEPLOCALDESC_ITQ_HPP
+#define EVALUATION_DEEPLOCALDESC_ITQ_HPP
+
+#include <pca.hpp>
+#include <kernels.hpp>
+#include <random>
+#include <cstdint>
+#include <climits>
+
+// Iterative quantization (Gong and Lazebnik, CVPR 2011): learns a rotation R of the
+// PCA-projected data V so that sign(V * R) loses as little as possible, which gives
+// L-bit binary codes compared with the Hamming distance.
+
+#define ITQ_ITERATIONS 50
+#define ITQ_CODES_MAGIC 0x42515449 // "ITQB"
+// Number of database codes scanned by all the queries of a thread before moving on
+#define HAMMING_BLOCK 4096
+
+inline size_t code_words (size_t nbits)
+{
+  return (nbits + 63) / 64;
+}
+
+// V: N x L zero-mean data (the output of pca()), R: L x L rotation
+inline bool itq (
+    const float *V,
+    float *&R,
+    size_t N,
+    size_t L,
+    int iterations)
+{
+  size_t i;
+  int it;
+  float *B = (float *) ::operator new (N * L * sizeof (float));
+  float *M = (float *) ::operator new (L * L * sizeof (float));
+  float *U = (float *) ::operator new (L * L * sizeof (float));
+  float *VT = (float *) ::operator new (L * L * sizeof (float));
+  float *s = (float *) ::operator new (L * sizeof (float));
+  float *superb = (float *) ::operator new (L * sizeof (float));
+  R = (float *) ::operator new (L * L * sizeof (float));
+  bool ok = true;
+
+  // Start from a random orthogonal matrix
+  std::mt19937 rng (0);
+  std::normal_distribution<float> normal (0.0f, 1.0f);
+  for (i = 0; i < L * L; i++)
+    M[i] = normal (rng);
+  if (LAPACKE_sgesvd (LAPACK_ROW_MAJOR, 'A', 'A', L, L, M, L, s, R, L, VT, L, superb) != 0)
+    {
+      ok = false;
+    }
+
+  for (it = 0; ok && it < iterations; it++)
+    {
+      // Fix R, update the codes: B = sign(V * R)
+      cblas_sgemm (
+          CblasRowMajor,
+          CblasNoTrans,
+          CblasNoTrans,
+          N, L, L,
+          1.0f,
+          V, L,
+          R, L,
+          0.0f,
+          B, L);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+      for (i = 0; i < N * L; i++)
+        B[i] = B[i] >= 0.0f ? 1.0f : -1.0f;
+
+      // Fix B, update the rotation: V' * B = U * S * VT, R = U * VT
+      cblas_sgemm (
+          CblasRowMajor,
+          CblasTrans,
+          CblasNoTrans,
+          L, L, N,
+          1.0f,
+          V, L,
+          B, L,
+          0.0f,
+          M, L);
+      if (LAPACKE_sgesvd (LAPACK_ROW_MAJOR, 'A', 'A', L, L, M, L, s, U, L, VT, L, superb) != 0)
+        {
+          ok = false;
+          break;
+        }
+      cblas_sgemm (
+          CblasRowMajor,
+          CblasNoTrans,
+          CblasNoTrans,
+          L, L, L,
+          1.0f,
+          U, L,
+          VT, L,
+          0.0f,
+          R, L);
+    }
+
+  ::delete B;
+  ::delete M;
+  ::delete U;
+  ::delete VT;
+  ::delete s;
+  ::delete superb;
+  return ok;
+}
+
+// Pack the signs of N rows of L floats into N * code_words(L) words, bit l of a row in word l / 64
+inline void pack_codes (
+    const float *data,
+    uint64_t *codes,
+    size_t N,
+    size_t L)
+{
+  size_t i, l;
+  size_t W = code_words (L);
+#ifdef _OPENMP
+#pragma omp parallel for private(l) schedule(static)
+#endif
+  for (i = 0; i < N; i++)
+    {
+      uint64_t *c = codes + i * W;
+      memset (c, 0, W * sizeof (uint64_t));
+      for (l = 0; l < L; l++)
+        if (data[i * L + l] >= 0.0f)
+          c[l >> 6] |= (uint64_t) 1 << (l & 63);
+    }
+}
+
+// Code files: uint32 magic, uint32 number of bits, then code_words(bits) uint64 words per code
+inline bool save_codes (
+    std::string fName,
+    const uint64_t *codes,
+    size_t N,
+    size_t nbits)
+{
+  int fd = open (fName.c_str (), O_WRONLY | O_CREAT | O_TRUNC, (mode_t) 0600);
+  if (fd < 0)
+    {
+      return false;
+    }
+  uint32_t header[2] = {ITQ_CODES_MAGIC, (uint32_t) nbits};
+  if (write (fd, header, sizeof (header)) != sizeof (header))
+    {
+      close (fd);
+      return false;
+    }
+  // The codes are written straight from the caller's buffer, without a copy
+  size_t bytes = N * code_words (nbits) * sizeof (uint64_t), done = 0;
+  while (done < bytes)
+    {
+      ssize_t status = write (fd, (const unsigned char *) codes + done, bytes - done);
+      if (status <= 0)
+        {
+          close (fd);
+          return false;
+        }
+      done += status;
+    }
+  return close (fd) == 0;
+}
+
+inline size_t load_codes (
+    std::string fName,
+    uint64_t *&codes,
+    size_t &nbits)
+{
+  const char *filename = fName.c_str ();
+  int fd = open (filename, O_RDONLY);
+  if (fd < 0)
+    {
+      return -1;
+    }
+  size_t size = get_file_size (filename);
+  uint32_t header[2];
+  if (size < sizeof (header) || read (fd, header, sizeof (header)) != sizeof (header)
+      || header[0] != ITQ_CODES_MAGIC || header[1] == 0)
+    {
+      close (fd);
+      return -1;
+    }
+  nbits = header[1];
+  size_t W = code_words (nbits);
+  size_t N = (size - sizeof (header)) / (W * sizeof (uint64_t));
+  codes = (uint64_t *) ::operator new (N * W * sizeof (uint64_t));
+  size_t bytes = N * W * sizeof (uint64_t), done = 0;
+  while (done < bytes)
+    {
+      ssize_t status = read (fd, (unsigned char *) codes + done, bytes - done);
+      if (status <= 0)
+        {
+          close (fd);
+          return -1;
+        }
+      done += status;
+    }
+  close (fd);
+  return N;
+}
+
+// Keeps the k smallest (distance, id) pairs seen so far, largest one on top.
+// ids are int, as in the .ivecs output, so the database has at most INT_MAX codes.
+struct hamming_topk
+{
+  std::vector<std::pair<uint32_t, int> > heap;
+  size_t k;
+
+  // Distances below the bound enter the heap; nothing does when k is 0
+  inline uint32_t bound () const
+  {
+    if (k == 0)
+      return 0;
+    return heap.size () < k ? UINT32_MAX : heap.front ().first;
+  }
+
+  inline void push (uint32_t dist, int id)
+  {
+    if (heap.size () < k)
+      {
+        heap.push_back (std::make_pair (dist, id));
+        std::push_heap (heap.begin (), heap.end ());
+      }
+    else if (dist < heap.front ().first)
+      {
+        std::pop_heap (heap.begin (), heap.end ());
+        heap.back () = std::make_pair (dist, id);
+        std::push_heap (heap.begin (), heap.end ());
+      }
+  }
+};
+
+template<size_t W>
+__attribute__((always_inline)) inline uint32_t hamming_fixed (
+    const uint64_t *a,
+    const uint64_t *b,
+    size_t)
+{
+  uint32_t d = 0;
+  size_t w;
+  for (w = 0; w < W; w++)
+    d += __builtin_popcountll (a[w] ^ b[w]);
+  return d;
+}
+
+__attribute__((always_inline)) inline uint32_t hamming_any (
+    const uint64_t *a,
+    const uint64_t *b,
+    size_t W)
+{
+  uint32_t d = 0;
+  size_t w;
+  for (w = 0; w < W; w++)
+    d += __builtin_popcountll (a[w] ^ b[w]);
+  return d;
+}
+
+// Scans the database block [b0, b1) for the queries [q0, q1)
+typedef void (*hamming_scan_fn) (
+    const uint64_t *queries,
+    const uint64_t *base,
+    hamming_topk *topk,
+    size_t q0,
+    size_t q1,
+    size_t b0,
+    size_t b1,
+    size_t W);
+
+template<uint32_t (*distance) (const uint64_t *, const uint64_t *, size_t)>
+__attribute__((always_inline)) inline void hamming_scan_block_impl (
+    const uint64_t *queries,
+    const uint64_t *base,
+    hamming_topk *topk,
+    size_t q0,
+    size_t q1,
+    size_t b0,
+    size_t b1,
+    size_t W)
+{
+  size_t q, b;
+  for (q = q0; q < q1; q++)
+    {
+      const uint64_t *c = queries + q * W;
+      hamming_topk &best = topk[q];
+      uint32_t bound = best.bound ();
+      for (b = b0; b < b1; b++)
+        {
+          uint32_t d = distance (c, base + b * W, W);
+          if (d < bound)
+            {
+              best.push (d, (int) b);
+              bound = best.bound ();
+            }
+        }
+    }
+}
+
+template<uint32_t (*distance) (const uint64_t *, const uint64_t *, size_t)>
+void hamming_scan_block (
+    const uint64_t *queries,
+    const uint64_t *base,
+    hamming_topk *topk,
+    size_t q0,
+    size_t q1,
+    size_t b0,
+    size_t b1,
+    size_t W)
+{
+  hamming_scan_block_impl<distance> (queries, base, topk, q0, q1, b0, b1, W);
+}
+
+#ifdef KERNELS_X86
+// Same loop, compiled with the popcnt instruction
+template<uint32_t (*distance) (const uint64_t *, const uint64_t *, size_t)>
+__attribute__((target ("popcnt")))
+void hamming_scan_block_popcnt (
+    const uint64_t *queries,
+    const uint64_t *base,
+    hamming_topk *topk,
+    size_t q0,
+    size_t q1,
+    size_t b0,
+    size_t b1,
+    size_t W)
+{
+  hamming_scan_block_impl<distance> (queries, base, topk, q0, q1, b0, b1, W);
+}
+#endif
+
+template<uint32_t (*distance) (const uint64_t *, const uint64_t *, size_t)>
+inline hamming_scan_fn select_hamming_scan ()
+{
+#ifdef KERNELS_X86
+  if (__builtin_cpu_supports ("popcnt"))
+    return hamming_scan_block_popcnt<distance>;
+#endif
+  return hamming_scan_block<distance>;
+}
+
+// k nearest database codes of each query in Hamming distance.
+// ids and dists must hold nq * k values; missing neighbours get id -1.
+// Returns false if the database has more codes than an int id can hold.
+inline bool hamming_knn (
+    const uint64_t *queries,
+    const uint64_t *base,
+    int *ids,
+    int *dists,
+    size_t nq,
+    size_t nb,
+    size_t nbits,
+    size_t k)
+{
+  size_t q, j;
+  size_t W = code_words (nbits);
+  if (nb > (size_t) INT_MAX)
+    {
+      return false;
+    }
+  if (k == 0)
+    {
+      return true;
+    }
+  std::vector<hamming_topk> topk (nq);
+  for (q = 0; q < nq; q++)
+    {
+      topk[q].k = k;
+      topk[q].heap.reserve (k + 1);
+    }
+
+  hamming_scan_fn scan;
+  switch (W)
+    {
+      case 1:
+        scan = select_hamming_scan<hamming_fixed<1> > ();
+        break;
+      case 2:
+        scan = select_hamming_scan<hamming_fixed<2> > ();
+        break;
+      case 4:
+        scan = select_hamming_scan<hamming_fixed<4> > ();
+        break;
+      default:
+        scan = select_hamming_scan<hamming_any> ();
+    }
+
+  size_t nthreads = 1;
+#ifdef _OPENMP
+  nthreads = omp_get_max_threads ();
+#endif
+  if (nq >= nthreads)
+    {
+      // Each thread takes a static chunk of queries and runs them over the database block by
+      // block, so that a block is read from memory once and then served from the cache.
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+      {
+        size_t q0 = 0, q1 = nq, b0;
+#ifdef _OPENMP
+        size_t nt = omp_get_num_threads (), t = omp_get_thread_num ();
+        q0 = nq * t / nt;
+        q1 = nq * (t + 1) / nt;
+#endif
+        for (b0 = 0; b0 < nb; b0 += HAMMING_BLOCK)
+          scan (queries, base, topk.data (), q0, q1, b0, std::min (nb, (size_t) b0 + HAMMING_BLOCK), W);
+      }
+    }
+  else
+    {
+      // Too few queries to keep every thread busy (e.g. one online query): each thread scans a
+      // static chunk of the database for all the queries into its own heaps, which are then
+      // merged. Each heap holds the k smallest (distance, id) pairs of its chunk, so the merge
+      // gives the same neighbours as a single scan.
+      std::vector<std::vector<hamming_topk> > local (nthreads, topk);
+#ifdef _OPENMP
+#pragma omp parallel num_threads(nthreads)
+#endif
+      {
+        size_t t = 0, b0, b1;
+#ifdef _OPENMP
+        t = omp_get_thread_num ();
+#endif
+        b1 = nb * (t + 1) / nthreads;
+        for (b0 = nb * t / nthreads; b0 < b1; b0 += HAMMING_BLOCK)
+          scan (queries, base, local[t].data (), 0, nq, b0, std::min (b1, (size_t) b0 + HAMMING_BLOCK), W);
+      }
+      for (q = 0; q < nq; q++)
+        for (j = 0; j < nthreads; j++)
+          topk[q].heap.insert (topk[q].heap.end (), local[j][q].heap.begin (), local[j][q].heap.end ());
+    }
+
+  for (q = 0; q < nq; q++)
+    {
+      std::sort (topk[q].heap.begin (), topk[q].heap.end ());
+      for (j = 0; j < k; j++)
+        {
+          ids[q * k + j] = j < topk[q].heap.size () ? topk[q].heap[j].second : -1;
+          dists[q * k + j] = j < topk[q].heap.size () ? (int) topk[q].heap[j].first : -1;
+        }
+    }
+  return true;
+}
+
+#endif //EVALUATION_DEEPLOCALDESC_ITQ_HPP
@@ -0,0 +1,465 @@
+/*
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVALUATION_DEEPLOCALDESC_KERNELS_HPP
+#define EVALUATION_DEEPLOCALDESC_KERNELS_HPP
+
+#include <cstddef>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KERNELS_X86
+#include <immintrin.h>
+#endif
+
+// Projection and distance kernels specialized for the dimensions we run:
+// D = 128, 256, 512, 4096 and L = 32, 64, 128, 256.
+// Projection has an AVX2 and an AVX-512 version, distance also a portable one; the version
+// matching the CPU is chosen at runtime. select_project_rows returns nullptr for other sizes
+// and CPUs, which then use sgemm, and project() only uses it for the shapes and batch sizes
+// where it clearly beats sgemm (project_kernel_rows, measured with bench_kernels).
+
+// out[i] = ((x[i] - shift) * inv) * pca for N rows x[i] of D floats; pca is D x L, row-major.
+typedef void (*project_rows_fn) (
+    const float *data,
+    float *out,
+    const float *pca,
+    const float *shift,
+    const float *inv,
+    size_t N);
+
+// Squared L2 distance between two vectors of L floats
+typedef float (*distance_fn) (
+    const float *a,
+    const float *b,
+    size_t L);
+
+enum cpu_level_t
+{
+  CPU_GENERIC = 0,
+  CPU_AVX2 = 1,
+  CPU_AVX512 = 2
+};
+
+inline int cpu_level ()
+{
+#ifdef KERNELS_X86
+  static int level = __builtin_cpu_supports ("avx512f") ? CPU_AVX512
+                     : (__builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("fma")) ? CPU_AVX2
+                     : CPU_GENERIC;
+  return level;
+#else
+  return CPU_GENERIC;
+#endif
+}
+
+template<size_t L>
+inline float squared_l2_generic (
+    const float *a,
+    const float *b,
+    size_t)
+{
+  size_t l;
+  float s = 0.0f;
+  for (l = 0; l < L; l++)
+    s += (a[l] - b[l]) * (a[l] - b[l]);
+  return s;
+}
+
+inline float squared_l2_any (
+    const float *a,
+    const float *b,
+    size_t L)
+{
+  size_t l;
+  float s = 0.0f;
+  for (l = 0; l < L; l++)
+    s += (a[l] - b[l]) * (a[l] - b[l]);
+  return s;
+}
+
+#ifdef KERNELS_X86
+// Rows are projected in blocks of up to 4 (AVX2) or 8 (AVX-512) rows, one chunk of 32 (AVX2)
+// or 64 (AVX-512) columns of pca at a time: each row of the chunk of pca is loaded once for the
+// whole block, and the rows x W vectors of accumulators stay in registers. Blocks of fewer rows
+// use wider W, so that there are always enough independent multiply-adds in flight.
+// x holds the normalized rows.
+#define KERNEL_ROWS_AVX2 4
+#define KERNEL_ROWS_AVX512 8
+// Below this many multiply-adds a call stays on the calling thread
+#define KERNEL_PARALLEL_WORK (1 << 22)
+
+template<size_t D, size_t L, size_t RB>
+__attribute__((target ("avx2,fma"), always_inline))
+inline void project_block_avx2 (
+    const float *x,
+    const float *pca,
+    float *out,
+    size_t c0,
+    size_t c1)
+{
+  const size_t W = RB <= 2 ? 4 : 2;
+  size_t c, d, r, w;
+  for (c = c0; c < c1; c += 8 * W)
+    {
+      __m256 acc[RB][W];
+#pragma GCC unroll 16
+      for (r = 0; r < RB * W; r++)
+        acc[r / W][r % W] = _mm256_setzero_ps ();
+      for (d = 0; d < D; d++)
+        {
+          __m256 p[W];
+#pragma GCC unroll 4
+          for (w = 0; w < W; w++)
+            p[w] = _mm256_loadu_ps (pca + d * L + c + 8 * w);
+#pragma GCC unroll 4
+          for (r = 0; r < RB; r++)
+            {
+              __m256 xr = _mm256_broadcast_ss (x + r * D + d);
+#pragma GCC unroll 4
+              for (w = 0; w < W; w++)
+                acc[r][w] = _mm256_fmadd_ps (xr, p[w], acc[r][w]);
+            }
+        }
+#pragma GCC unroll 16
+      for (r = 0; r < RB * W; r++)
+        _mm256_storeu_ps (out + (r / W) * L + c + 8 * (r % W), acc[r / W][r % W]);
+    }
+}
+
+template<size_t D, size_t L, size_t RB>
+__attribute__((target ("avx512f"), always_inline))
+inline void project_block_avx512 (
+    const float *x,
+    const float *pca,
+    float *out,
+    size_t c0,
+    size_t c1)
+{
+  // The chunk is only 32 columns when L = 32
+  const size_t W = L < 64 ? 2 : RB <= 4 ? 4 : 2;
+  size_t c, d, r, w;
+  for (c = c0; c < c1; c += 16 * W)
+    {
+      __m512 acc[RB][W];
+#pragma GCC unroll 16
+      for (r = 0; r < RB * W; r++)
+        acc[r / W][r % W] = _mm512_setzero_ps ();
+      for (d = 0; d < D; d++)
+        {
+          __m512 p[W];
+#pragma GCC unroll 4
+          for (w = 0; w < W; w++)
+            p[w] = _mm512_loadu_ps (pca + d * L + c + 16 * w);
+#pragma GCC unroll 8
+          for (r = 0; r < RB; r++)
+            {
+              __m512 xr = _mm512_set1_ps (x[r * D + d]);
+#pragma GCC unroll 4
+              for (w = 0; w < W; w++)
+                acc[r][w] = _mm512_fmadd_ps (xr, p[w], acc[r][w]);
+            }
+        }
+#pragma GCC unroll 16
+      for (r = 0; r < RB * W; r++)
+        _mm512_storeu_ps (out + (r / W) * L + c + 16 * (r % W), acc[r / W][r % W]);
+    }
+}
+
+// Projects the rows [0, N) of x on the columns [c0, c1) of pca, chunk by chunk
+template<size_t D, size_t L>
+__attribute__((target ("avx2,fma")))
+void project_chunks_avx2 (
+    const float *x,
+    float *out,
+    const float *pca,
+    size_t N,
+    size_t c0,
+    size_t c1)
+{
+  size_t c, i;
+  for (c = c0; c < c1; c += 32)
+    {
+      for (i = 0; i + KERNEL_ROWS_AVX2 <= N; i += KERNEL_ROWS_AVX2)
+        project_block_avx2<D, L, KERNEL_ROWS_AVX2> (x + i * D, pca, out + i * L, c, c + 32);
+      switch (N - i)
+        {
+          case 3:
+            project_block_avx2<D, L, 3> (x + i * D, pca, out + i * L, c, c + 32);
+            break;
+          case 2:
+            project_block_avx2<D, L, 2> (x + i * D, pca, out + i * L, c, c + 32);
+            break;
+          case 1:
+            project_block_avx2<D, L, 1> (x + i * D, pca, out + i * L, c, c + 32);
+            break;
+        }
+    }
+}
+
+template<size_t D, size_t L>
+__attribute__((target ("avx512f")))
+void project_chunks_avx512 (
+    const float *x,
+    float *out,
+    const float *pca,
+    size_t N,
+    size_t c0,
+    size_t c1)
+{
+  const size_t chunk = L < 64 ? L : 64;
+  size_t c, i;
+  for (c = c0; c < c1; c += chunk)
+    {
+      for (i = 0; i + KERNEL_ROWS_AVX512 <= N; i += KERNEL_ROWS_AVX512)
+        project_block_avx512<D, L, KERNEL_ROWS_AVX512> (x + i * D, pca, out + i * L, c, c + chunk);
+      switch (N - i)
+        {
+          case 7:
+            project_block_avx512<D, L, 7> (x + i * D, pca, out + i * L, c, c + chunk);
+            break;
+          case 6:
+            project_block_avx512<D, L, 6> (x + i * D, pca, out + i * L, c, c + chunk);
+            break;
+          case 5:
+            project_block_avx512<D, L, 5> (x + i * D, pca, out + i * L, c, c + chunk);
+            break;
+          case 4:
+            project_block_avx512<D, L, 4> (x + i * D, pca, out + i * L, c, c + chunk);
+            break;
+          case 3:
+            project_block_avx512<D, L, 3> (x + i * D, pca, out + i * L, c, c + chunk);
+            break;
+          case 2:
+            project_block_avx512<D, L, 2> (x + i * D, pca, out + i * L, c, c + chunk);
+            break;
+          case 1:
+            project_block_avx512<D, L, 1> (x + i * D, pca, out + i * L, c, c + chunk);
+            break;
+        }
+    }
+}
+
+// Normalizes the N rows once, into a buffer kept per thread so that small calls do not allocate,
+// then splits the chunks of pca over the threads when the call is large enough: a thread only
+// reads its own columns of pca.
+template<size_t D, size_t L, size_t CHUNK>
+inline void project_rows_driver (
+    void (*chunks) (const float *, float *, const float *, size_t, size_t, size_t),
+    const float *data,
+    float *out,
+    const float *pca,
+    const float *shift,
+    const float *inv,
+    size_t N)
+{
+  static thread_local std::vector<float> x;
+  x.resize (N * D);
+  size_t i, d;
+  for (i = 0; i < N; i++)
+    for (d = 0; d < D; d++)
+      x[i * D + d] = (data[i * D + d] - shift[d]) * inv[d];
+  // Inside the parallel region x would name the buffer of each thread
+  const float *rows = x.data ();
+  if (N * D * L < KERNEL_PARALLEL_WORK)
+    {
+      chunks (rows, out, pca, N, 0, L);
+      return;
+    }
+  long c;
+#pragma omp parallel for schedule(static)
+  for (c = 0; c < (long) L; c += CHUNK)
+    chunks (rows, out, pca, N, c, c + CHUNK);
+}
+
+template<size_t D, size_t L>
+void project_rows_avx2 (
+    const float *data,
+    float *out,
+    const float *pca,
+    const float *shift,
+    const float *inv,
+    size_t N)
+{
+  project_rows_driver<D, L, 32> (project_chunks_avx2<D, L>, data, out, pca, shift, inv, N);
+}
+
+template<size_t D, size_t L>
+void project_rows_avx512 (
+    const float *data,
+    float *out,
+    const float *pca,
+    const float *shift,
+    const float *inv,
+    size_t N)
+{
+  project_rows_driver<D, L, (L < 64 ? L : 64)> (project_chunks_avx512<D, L>, data, out, pca, shift, inv, N);
+}
+
+// L is a multiple of 32 for all the specialized sizes
+template<size_t L>
+__attribute__((target ("avx2,fma")))
+float squared_l2_avx2 (
+    const float *a,
+    const float *b,
+    size_t)
+{
+  __m256 acc[4] = {_mm256_setzero_ps (), _mm256_setzero_ps (), _mm256_setzero_ps (), _mm256_setzero_ps ()};
+  size_t l, k;
+  for (l = 0; l < L; l += 32)
+    for (k = 0; k < 4; k++)
+      {
+        __m256 t = _mm256_sub_ps (_mm256_loadu_ps (a + l + 8 * k), _mm256_loadu_ps (b + l + 8 * k));
+        acc[k] = _mm256_fmadd_ps (t, t, acc[k]);
+      }
+  __m256 s = _mm256_add_ps (_mm256_add_ps (acc[0], acc[1]), _mm256_add_ps (acc[2], acc[3]));
+  __m128 h = _mm_add_ps (_mm256_castps256_ps128 (s), _mm256_extractf128_ps (s, 1));
+  h = _mm_add_ps (h, _mm_movehl_ps (h, h));
+  h = _mm_add_ss (h, _mm_shuffle_ps (h, h, 1));
+  return _mm_cvtss_f32 (h);
+}
+
+template<size_t L>
+__attribute__((target ("avx512f")))
+float squared_l2_avx512 (
+    const float *a,
+    const float *b,
+    size_t)
+{
+  __m512 acc[2] = {_mm512_setzero_ps (), _mm512_setzero_ps ()};
+  size_t l, k;
+  for (l = 0; l < L; l += 32)
+    for (k = 0; k < 2; k++)
+      {
+        __m512 t = _mm512_sub_ps (_mm512_loadu_ps (a + l + 16 * k), _mm512_loadu_ps (b + l + 16 * k));
+        acc[k] = _mm512_fmadd_ps (t, t, acc[k]);
+      }
+  return _mm512_reduce_add_ps (_mm512_add_ps (acc[0], acc[1]));
+}
+#endif
+
+template<size_t D, size_t L>
+inline project_rows_fn select_project_rows_fixed ()
+{
+#ifdef KERNELS_X86
+  switch (cpu_level ())
+    {
+      case CPU_AVX512:
+        return project_rows_avx512<D, L>;
+      case CPU_AVX2:
+        return project_rows_avx2<D, L>;
+    }
+#endif
+  return nullptr;
+}
+
+template<size_t D>
+inline project_rows_fn select_project_rows_l (size_t L)
+{
+  switch (L)
+    {
+      case 32:
+        return select_project_rows_fixed<D, 32> ();
+      case 64:
+        return select_project_rows_fixed<D, 64> ();
+      case 128:
+        return select_project_rows_fixed<D, 128> ();
+      case 256:
+        return select_project_rows_fixed<D, 256> ();
+    }
+  return nullptr;
+}
+
+inline project_rows_fn select_project_rows (
+    size_t D,
+    size_t L)
+{
+  switch (D)
+    {
+      case 128:
+        return select_project_rows_l<128> (L);
+      case 256:
+        return select_project_rows_l<256> (L);
+      case 512:
+        return select_project_rows_l<512> (L);
+      case 4096:
+        return select_project_rows_l<4096> (L);
+    }
+  return nullptr;
+}
+
+// Range of batch sizes [min_rows, max_rows] for which project() uses the kernel of (D, L).
+// Only the shapes where bench_kernels shows a clear margin over sgemm (1.2 to 2.5x with one
+// thread) qualify: the kernel reads each chunk of pca once for a whole block of rows, which pays
+// off when pca is large and the batch small. Elsewhere the two are within timing noise or sgemm
+// wins, so sgemm is kept. Returns false when (D, L) does not qualify.
+inline bool project_kernel_rows (
+    size_t D,
+    size_t L,
+    size_t &min_rows,
+    size_t &max_rows)
+{
+  if (D == 4096 && L <= 128)
+    {
+      min_rows = 4;
+      max_rows = 16;
+      return true;
+    }
+  if (D == 512 && L >= 128)
+    {
+      min_rows = 8;
+      max_rows = 32;
+      return true;
+    }
+  return false;
+}
+
+template<size_t L>
+inline distance_fn select_squared_l2_fixed ()
+{
+#ifdef KERNELS_X86
+  switch (cpu_level ())
+    {
+      case CPU_AVX512:
+        return squared_l2_avx512<L>;
+      case CPU_AVX2:
+        return squared_l2_avx2<L>;
+    }
+#endif
+  return squared_l2_generic<L>;
+}
+
+// Never returns nullptr: other sizes get the generic loop
+inline distance_fn select_squared_l2 (size_t L)
+{
+  switch (L)
+    {
+      case 32:
+        return select_squared_l2_fixed<32> ();
+      case 64:
+        return select_squared_l2_fixed<64> ();
+      case 128:
+        return select_squared_l2_fixed<128> ();
+      case 256:
+        return select_squared_l2_fixed<256> ();
+    }
+  return squared_l2_any;
+}
+
+#endif //EVALUATION_DEEPLOCALDESC_KERNELS_HPP
@@ -13,6 +13,10 @@
 #include <iostream>
 #include <pca.hpp>
 #include <extract_patches.hpp>
+#include <server.hpp>
+#include <threads.hpp>
+#include <itq.hpp>
+#include <verify.hpp>
 
 using namespace std;
 int main (int argc, char * argv[])
@@ -21,9 +25,17 @@ int main (int argc, char * argv[])
   std::string command;
   std::string input_file;
   std::string output_file;
+  std::string cache_dir;
+  std::string model_file;
+  std::string shortlist_file;
+  bool homography = false;
+  int iterations = ITQ_ITERATIONS;
   unsigned int D, radius;
+  float pos_tolerance = 0.0f, scale_tolerance = 0.0f;
+  int omp_threads = 0, blas_threads = 0;
+  bool pin = false;
 
-  while((result=getopt(argc,argv,"c:i:d:r:o:"))!=-1){
+  while((result=getopt(argc,argv,"c:i:d:r:o:t:s:k:p:b:am:n:l:g:"))!=-1){
       switch(result){
           case 'c':
             command = std::string(optarg);
@@ -45,6 +57,46 @@ int main (int argc, char * argv[])
             output_file = std::string(optarg);
             break;
 
+          case 't':
+            pos_tolerance = atof(optarg);
+            break;
+
+          case 's':
+            scale_tolerance = atof(optarg);
+            break;
+
+          case 'k':
+            cache_dir = std::string(optarg);
+            break;
+
+          case 'p':
+            omp_threads = atoi(optarg);
+            break;
+
+          case 'b':
+            blas_threads = atoi(optarg);
+            break;
+
+          case 'a':
+            pin = true;
+            break;
+
+          case 'm':
+            model_file = std::string(optarg);
+            break;
+
+          case 'n':
+            iterations = atoi(optarg);
+            break;
+
+          case 'l':
+            shortlist_file = std::string(optarg);
+            break;
+
+          case 'g':
+            homography = std::string(optarg) == "homography";
+            break;
+
           case ':':
             std::cout << result << " needs value" << std::endl;
             break;
@@ -55,6 +107,17 @@ int main (int argc, char * argv[])
         }
     }
 
+  set_num_threads (omp_threads, blas_threads);
+  // The server threads would inherit the single-CPU mask of the pinned main thread
+  if (pin && command == "serve_pca")
+    {
+      std::cerr << "-a is ignored with serve_pca" << std::endl;
+    }
+  else if (pin && !pin_threads ())
+    {
+      std::cerr << "Cannot pin the threads" << std::endl;
+    }
+
   if (command == "compute_pca")
     {
       std::cout << "We will learn PCA" << std::endl;
@@ -64,24 +127,238 @@ int main (int argc, char * argv[])
       size_t n = load_data (input_file,data,id,0,D);
       ::delete id;
       // Learn PCs: mean subtraction is already included.
-      pca (data, pc, n, D, radius);
+      float * stats = (float *) ::operator new (2 * D * sizeof (float));
+      pca (data, pc, n, D, radius, stats, stats + D);
       // Save PCs data
       if (save_data (output_file, pc, D, radius, nullptr, false) < 0)
         {
           std::cerr << "Cannot save data" << std::endl;
         }
+      // Save the column means and standard deviations, needed to project new data
+      if (!save_data (output_file + ".mean", stats, 2, D, nullptr, false))
+        {
+          std::cerr << "Cannot save data" << std::endl;
+        }
       ::delete data;
       ::delete pc;
+      ::delete stats;
+    }
+  else if (command == "serve_pca")
+    {
+      std::cout << "We will serve PCA projections on " << output_file << std::endl;
+      float * pc, * stats = nullptr;
+      // load_data leaves id untouched when it cannot open the file
+      int * id = nullptr;
+      // The PCs are stored as D rows of L floats
+      size_t n = load_data (input_file, pc, id, 0, radius);
+      ::delete id;
+      if (n != D)
+        {
+          std::cerr << "Cannot load the PCs" << std::endl;
+          return 1;
+        }
+      id = nullptr;
+      size_t m = load_data (input_file + ".mean", stats, id, 0, D);
+      ::delete id;
+      if (m != 2)
+        {
+          std::cout << "No mean file, the data will be projected as is" << std::endl;
+          stats = nullptr;
+        }
+      if (!run_projection_server (output_file, pc, stats, stats == nullptr ? nullptr : stats + D, D, radius))
+        {
+          std::cerr << "Cannot listen on " << output_file << std::endl;
+          return 1;
+        }
+    }
+  else if (command == "train_itq")
+    {
+      std::cout << "We will learn PCA and ITQ" << std::endl;
+      float * data, * pc, * R;
+      int * id = nullptr;
+      size_t n = load_data (input_file,data,id,0,D);
+      ::delete id;
+      if (n == (size_t) -1)
+        {
+          std::cerr << "Cannot load data" << std::endl;
+          return 1;
+        }
+      if (radius > D) radius = D;
+      float * stats = (float *) ::operator new (2 * D * sizeof (float));
+      // data is projected onto the PCs here, then rotated by ITQ
+      pca (data, pc, n, D, radius, stats, stats + D);
+      if (!itq (data, R, n, radius, iterations))
+        {
+          std::cerr << "Cannot learn ITQ" << std::endl;
+          return 1;
+        }
+      // Save PCs * R, so that the codes are the signs of project() with this model
+      float * model = (float *) ::operator new (D * radius * sizeof (float));
+      cblas_sgemm (CblasRowMajor, CblasNoTrans, CblasNoTrans, D, radius, radius,
+                   1.0f, pc, radius, R, radius, 0.0f, model, radius);
+      if (!save_data (output_file, model, D, radius, nullptr, false)
+          || !save_data (output_file + ".mean", stats, 2, D, nullptr, false))
+        {
+          std::cerr << "Cannot save data" << std::endl;
+        }
+      ::delete data;
+      ::delete pc;
+      ::delete R;
+      ::delete model;
+      ::delete stats;
+    }
+  else if (command == "encode_itq")
+    {
+      std::cout << "We will encode the features to binary codes" << std::endl;
+      float * data, * model, * stats;
+      int * id = nullptr;
+      size_t n = load_data (input_file,data,id,0,D);
+      ::delete id;
+      if (n == (size_t) -1)
+        {
+          std::cerr << "Cannot load data" << std::endl;
+          return 1;
+        }
+      id = nullptr;
+      size_t m = load_data (model_file,model,id,0,radius);
+      ::delete id;
+      if (m != D)
+        {
+          std::cerr << "Cannot load the ITQ model" << std::endl;
+          return 1;
+        }
+      id = nullptr;
+      m = load_data (model_file + ".mean",stats,id,0,D);
+      ::delete id;
+      if (m != 2)
+        {
+          std::cerr << "Cannot load the mean file" << std::endl;
+          return 1;
+        }
+      float * out = (float *) ::operator new (n * radius * sizeof (float));
+      uint64_t * codes = (uint64_t *) ::operator new (n * code_words (radius) * sizeof (uint64_t));
+      project (data, out, model, stats, stats + D, n, D, radius, false);
+      pack_codes (out, codes, n, radius);
+      if (!save_codes (output_file, codes, n, radius))
+        {
+          std::cerr << "Cannot save data" << std::endl;
+        }
+      ::delete data;
+      ::delete model;
+      ::delete stats;
+      ::delete out;
+      ::delete codes;
+    }
+  else if (command == "search_hamming")
+    {
+      std::cout << "We will search the " << radius << " nearest codes" << std::endl;
+      uint64_t * queries, * base;
+      size_t qbits, bbits;
+      size_t nq = load_codes (input_file, queries, qbits);
+      size_t nb = load_codes (model_file, base, bbits);
+      if (nq == (size_t) -1 || nb == (size_t) -1 || qbits != bbits)
+        {
+          std::cerr << "Cannot load the codes" << std::endl;
+          return 1;
+        }
+      int * ids = (int *) ::operator new (nq * radius * sizeof (int));
+      int * dists = (int *) ::operator new (nq * radius * sizeof (int));
+      if (!hamming_knn (queries, base, ids, dists, nq, nb, qbits, radius))
+        {
+          std::cerr << "Too many database codes for int ids" << std::endl;
+          return 1;
+        }
+      if (!save_data (output_file, ids, nq, radius, nullptr, false)
+          || !save_data (output_file + ".dist", dists, nq, radius, nullptr, false))
+        {
+          std::cerr << "Cannot save data" << std::endl;
+        }
+      ::delete queries;
+      ::delete base;
+      ::delete ids;
+      ::delete dists;
+    }
+  else if (command == "rerank")
+    {
+      std::cout << "We will re-rank the candidates by spatial verification" << std::endl;
+      std::vector<std::pair<std::string, std::string> > query_list, database_list;
+      if (!load_image_list (input_file, query_list) || !load_image_list (model_file, database_list))
+        {
+          std::cerr << "Cannot load the image lists" << std::endl;
+          return 1;
+        }
+      int * shortlist, * id = nullptr;
+      size_t nq = load_data (shortlist_file, shortlist, id, 0, radius);
+      ::delete id;
+      if (nq != query_list.size ())
+        {
+          std::cerr << "The shortlist does not match the queries" << std::endl;
+          return 1;
+        }
+
+      // Load every query, and the database images which appear in a shortlist
+      std::vector<image_features> queries (nq), database (database_list.size ());
+      std::vector<bool> needed (database_list.size (), false);
+      for (size_t i = 0; i < nq * radius; ++i)
+        {
+          if (shortlist[i] >= 0 && shortlist[i] < (int) needed.size ())
+            needed[shortlist[i]] = true;
+        }
+      for (size_t i = 0; i < nq; ++i)
+        {
+          if (!load_image_features (query_list[i].first, query_list[i].second, D, queries[i]))
+            std::cerr << "Cannot load " << query_list[i].first << std::endl;
+        }
+      for (size_t i = 0; i < database.size (); ++i)
+        {
+          if (needed[i] && !load_image_features (database_list[i].first, database_list[i].second, D, database[i]))
+            std::cerr << "Cannot load " << database_list[i].first << std::endl;
+        }
+
+      int * ranked = (int *) ::operator new (nq * radius * sizeof (int));
+      int * inliers = (int *) ::operator new (nq * radius * sizeof (int));
+      rerank (queries, database, shortlist, ranked, inliers, radius, D, homography, VERIFY_MIN_INLIERS);
+      if (!save_data (output_file, ranked, nq, radius, nullptr, false)
+          || !save_data (output_file + ".inliers", inliers, nq, radius, nullptr, false))
+        {
+          std::cerr << "Cannot save data" << std::endl;
+        }
+      ::delete shortlist;
+      ::delete ranked;
+      ::delete inliers;
     }
   else if (command == "extract_patches")
     {
       std::cout << "We will extract patches and save to output folders" << std::endl;
       int nframes;
       std::vector<cv::Mat> patches;
-      extract_patches (input_file, patches, radius, nframes);
-      for (int i = 0; i < patches.size (); ++i)
+      std::vector<std::vector<int> > duplicates;
+      std::vector<cv::KeyPoint> geometry, detections;
+      bool hit;
+      extract_patches_cached (cache_dir, input_file, patches, duplicates, geometry, detections, radius, nframes, pos_tolerance, scale_tolerance, hit);
+      if (hit)
+        std::cout << "Loaded patches from the cache" << std::endl;
+      std::cout << patches.size () << " of " << nframes << " keypoints kept" << std::endl;
+      // Save which keypoints were merged into each patch: "<patch> <keypoint> <keypoint> ...",
+      // patches numbered from 1 as the images, keypoints as 0-based rows of detections.fvecs
+      std::ofstream dup_file (output_file + "/duplicates.txt");
+      for (size_t i = 0; i < patches.size (); ++i)
         {
           cv::imwrite (output_file + "/" + std::to_string (i+1) + ".jpg", patches.at (i));
+          dup_file << (i+1);
+          for (size_t j = 0; j < duplicates[i].size (); ++j)
+            dup_file << " " << duplicates[i][j];
+          dup_file << std::endl;
+        }
+      dup_file.close ();
+      // Save the keypoint of each patch, in the same order as the patches, and every detection
+      std::vector<float> values, all_values;
+      keypoints_to_floats (geometry, values);
+      keypoints_to_floats (detections, all_values);
+      if (!save_data (output_file + "/keypoints.fvecs", values.data (), geometry.size (), KEYPOINT_FIELDS, nullptr, false)
+          || !save_data (output_file + "/detections.fvecs", all_values.data (), detections.size (), KEYPOINT_FIELDS, nullptr, false))
+        {
+          std::cerr << "Cannot save data" << std::endl;
         }
       patches.clear ();
     }
@@ -23,8 +23,10 @@
 #include <algorithm>
 #include <vector>
 #include <cstring>
+#include <cmath>
 #include <cblas.h>
 #include <lapacke.h>
+#include <kernels.hpp>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <unistd.h>
@@ -40,23 +42,44 @@ inline void vector_mean_columns (
     size_t dimension)
 {
   size_t i, j;
-  float tmp;
   v = (float *) ::operator new (dimension * sizeof (float));
-  for (i = 0; i < dimension; i++)
-    {
-      tmp = 0.0;
+  memset (v, 0, dimension * sizeof (float));
+  // Each thread sums its own block of rows, with the same partitioning as the row loops
+  // below, so that it only reads the pages it touched first in load_data().
+#ifdef _OPENMP
+#pragma omp parallel private(i, j)
+#endif
+  {
+    float *partial = (float *) ::operator new (dimension * sizeof (float));
+    memset (partial, 0, dimension * sizeof (float));
+#ifdef _OPENMP
+#pragma omp for schedule(static) nowait
+#endif
+    for (j = 0; j < numRows; j++)
+      {
+        float *v_tmp = data + j * dimension;
 #if defined(_OPENMP)  && _OPENMP >= 201307
-      #pragma omp parallel for simd reduction(+:tmp)
+        #pragma omp simd
 #pragma ivdep
-#elif defined(_OPENMP) && _OPENMP < 201307
-#pragma omp parallel for reduction(+:tmp)
 #endif
-      for (j = 0; j < numRows; j++)
-        {
-          tmp += data[i + j * dimension];
-        }
+        for (i = 0; i < dimension; i++)
+          {
+            partial[i] += v_tmp[i];
+          }
+      }
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+    for (i = 0; i < dimension; i++)
+      {
+        v[i] += partial[i];
+      }
+    ::delete partial;
+  }
 
-      v[i] = tmp / numRows;
+  for (i = 0; i < dimension; i++)
+    {
+      v[i] /= numRows;
     }
 }
 
@@ -69,7 +92,7 @@ inline void vector_mean_rows (
   size_t i, j;
   v = (float *) ::operator new (numRows * sizeof (float));
 #ifdef _OPENMP
-#pragma omp parallel for
+#pragma omp parallel for schedule(static)
 #endif
   for (i = 0; i < numRows; i++)
     {
@@ -95,7 +118,7 @@ inline void subtract_mean (
 {
   size_t i, j;
 #ifdef _OPENMP
-#pragma omp parallel for
+#pragma omp parallel for schedule(static)
 #endif
   for (i = 0; i < numRows; i++)
     {
@@ -115,11 +138,14 @@ inline void cov (
     float *&v,
     float *&C,
     size_t n,
-    size_t d)
+    size_t d,
+    float *mean = nullptr) // if given, the d column means are copied here
 {
   float *mv;
   vector_mean_columns (v, mv, n, d);
   subtract_mean (v, mv, n, d);
+  if (mean != nullptr)
+    memcpy (mean, mv, d * sizeof (float));
 
   // Compute the co-variance matrix C
   // Since E[v] = 0 now, so C=1/(n-1) * v' * v
@@ -180,13 +206,15 @@ inline void pca (
     float *&pca,
     size_t N,
     size_t D,
-    size_t L)
+    size_t L,
+    float *mean = nullptr, // if given, the D column means are copied here
+    float *scale = nullptr) // if given, the D column standard deviations are copied here
 {
   size_t i, j;
   float *C;
 
   // Compute the co-variance
-  cov (data, C, N, D);
+  cov (data, C, N, D, mean);
   float *c = (float *) ::operator new (D * sizeof (float));
 #if defined(_OPENMP)  && _OPENMP >= 201307
   #pragma omp parallel for simd
@@ -194,7 +222,8 @@ inline void pca (
 #endif
   for (i = 0; i < D; i++)
     c[i] = sqrt (C[i * D + i]);
-
+  if (scale != nullptr)
+    memcpy (scale, c, D * sizeof (float));
 
   // Solve eigenvalues-eigenvectors problem of C
   // Note: C is symmetric!
@@ -217,12 +246,13 @@ inline void pca (
   // Rotate the matrix data by z: data = data * z
   tmp = (float *) ::operator new (N * L * sizeof (float));
 #if defined(_OPENMP)
-#pragma omp parallel for private(j)
+#pragma omp parallel for private(j) schedule(static)
 #endif
   for (i = 0; i < N; i++)
     {
+      // Already inside the parallel row loop: vectorize only, do not fork again
 #if defined(_OPENMP)  && _OPENMP >= 201307
-      #pragma omp parallel for simd
+      #pragma omp simd
 #pragma ivdep
 #endif
       for (j = 0; j < D; j++)
@@ -244,6 +274,85 @@ inline void pca (
   memcpy (data, tmp, N * L * sizeof (float));
 }
 
+// Project new data with a model learnt by pca(): out = ((data - mean) / scale) * pca.
+// data may be modified in place, out must hold N * L floats. mean and scale may be null.
+inline void project (
+    float *data,
+    float *out,
+    const float *pca,
+    const float *mean,
+    const float *scale,
+    size_t N,
+    size_t D,
+    size_t L,
+    bool normalize)
+{
+  size_t i, j, min_rows, max_rows;
+  // The fixed-size kernels only for the batch sizes where they beat sgemm
+  project_rows_fn kernel = nullptr;
+  if (project_kernel_rows (D, L, min_rows, max_rows) && N >= min_rows && N <= max_rows)
+    kernel = select_project_rows (D, L);
+  if (kernel != nullptr)
+    {
+      std::vector<float> shift (D, 0.0f), inv (D, 1.0f);
+      for (j = 0; j < D; j++)
+        {
+          if (mean != nullptr)
+            shift[j] = mean[j];
+          if (scale != nullptr)
+            inv[j] = 1.0f / scale[j];
+        }
+      kernel (data, out, pca, shift.data (), inv.data (), N);
+    }
+  else
+    {
+#if defined(_OPENMP)
+#pragma omp parallel for private(j) schedule(static)
+#endif
+      for (i = 0; i < N; i++)
+        {
+          float *v_tmp = data + i * D;
+          if (mean != nullptr)
+            for (j = 0; j < D; j++)
+              v_tmp[j] -= mean[j];
+          if (scale != nullptr)
+            for (j = 0; j < D; j++)
+              v_tmp[j] /= scale[j];
+        }
+
+      cblas_sgemm (
+          CblasRowMajor,
+          CblasNoTrans,
+          CblasNoTrans,
+          N, L, D,
+          1.0f,
+          data, D,
+          pca, L,
+          0.0f,
+          out, L);
+    }
+
+  if (!normalize)
+    return;
+  // L2-normalize the projected descriptors
+#if defined(_OPENMP)
+#pragma omp parallel for private(j) schedule(static)
+#endif
+  for (i = 0; i < N; i++)
+    {
+      float *v_tmp = out + i * L;
+      float norm = 0.0f;
+      for (j = 0; j < L; j++)
+        norm += v_tmp[j] * v_tmp[j];
+      if (norm > 0.0f)
+        {
+          norm = 1.0f / sqrt (norm);
+          for (j = 0; j < L; j++)
+            v_tmp[j] *= norm;
+        }
+    }
+}
+
 inline size_t get_file_size (const char *filename)
 {
   if (filename == nullptr)
@@ -301,12 +410,8 @@ inline size_t load_data (
       return -1;
     }
 
-  size_t i, j, base = 0, count = 0, count_id = 0;
-  DataType f[1];
-  int id[1];
+  size_t i;
   size_t d1 = d * sizeof (DataType) + header;
-  size_t ss = header > sizeof (DataType) ? header : sizeof (DataType);
-  unsigned char uc, buf[ss];
   size_t total_row = size / d1;
   try
     {
@@ -314,25 +419,21 @@ inline size_t load_data (
       ids = (int *) ::operator new (total_row * sizeof (int));
 
       /* Load data */
-      while (count < total_row * d && base < size)
+      // Rows are copied in parallel with the same static partitioning as the compute loops,
+      // so that on NUMA hosts each page is first touched by the thread which later uses it.
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+      for (i = 0; i < total_row; i++)
         {
+          const unsigned char *row = mapped + i * d1;
           // load header
-          for (i = 0; i < header; i++)
-            {
-              buf[i] = mapped[base++];
-            }
-          memcpy (id, buf, sizeof (int));
-          ids[count_id++] = id[0];
+          int id = 0;
+          if (header >= (int) sizeof (int))
+            memcpy (&id, row, sizeof (int));
+          ids[i] = id;
           // load data
-          for (i = 0; i < d; i++)
-            {
-              for (j = 0; j < sizeof (DataType); j++)
-                {
-                  buf[j] = mapped[base++];
-                }
-              memcpy (f, buf, sizeof (DataType));
-              data[count++] = f[0];
-            }
+          memcpy (data + i * d, row + header, d * sizeof (DataType));
         }
     }
   catch (std::exception &e)
@@ -346,7 +447,7 @@ inline size_t load_data (
     }
   close (fd);
 
-  return count / d;
+  return total_row;
 }
 
 template<typename DataType>
@@ -0,0 +1,273 @@
+/*
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVALUATION_DEEPLOCALDESC_SERVER_HPP
+#define EVALUATION_DEEPLOCALDESC_SERVER_HPP
+
+#include <pca.hpp>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <new>
+#include <chrono>
+#include <iostream>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Projection server: keeps a PCA model in memory and projects descriptors sent over a Unix socket.
+// Request:  uint32 n, uint32 d, then n * d floats (d must be the dimension of the model)
+// Response: uint32 n, uint32 L, then n * L projected and L2-normalized floats
+// A connection may send any number of requests. Requests from all connections are
+// gathered into a single batch so that one GEMM serves all of them.
+
+// Largest request payload accepted, and largest batch gathered by the worker, in bytes.
+// Bigger requests close the connection.
+#define PROJECTION_SERVER_MAX_BYTES ((size_t) 64 << 20)
+
+struct projection_request
+{
+  float *data;
+  float *out;
+  size_t n;
+  bool done;
+};
+
+struct projection_model
+{
+  const float *pca;
+  const float *mean;
+  const float *scale;
+  size_t D;
+  size_t L;
+
+  std::mutex lock;
+  std::condition_variable pending;
+  std::condition_variable finished;
+  std::deque<projection_request *> queue;
+};
+
+inline bool recv_all (
+    int fd,
+    void *buf,
+    size_t size)
+{
+  unsigned char *p = (unsigned char *) buf;
+  while (size > 0)
+    {
+      ssize_t status = recv (fd, p, size, 0);
+      if (status <= 0)
+        {
+          return false;
+        }
+      p += status;
+      size -= status;
+    }
+  return true;
+}
+
+inline bool send_all (
+    int fd,
+    const void *buf,
+    size_t size)
+{
+  const unsigned char *p = (const unsigned char *) buf;
+  while (size > 0)
+    {
+      ssize_t status = send (fd, p, size, MSG_NOSIGNAL);
+      if (status <= 0)
+        {
+          return false;
+        }
+      p += status;
+      size -= status;
+    }
+  return true;
+}
+
+// Takes every queued request, projects them with one GEMM and wakes their connections up
+inline void projection_worker (projection_model *model)
+{
+  std::vector<projection_request *> batch;
+  std::vector<float> in, out;
+  size_t i, n;
+  while (true)
+    {
+      {
+        std::unique_lock<std::mutex> guard (model->lock);
+        while (model->queue.empty ())
+          model->pending.wait (guard);
+        // Take requests up to the batch size limit; the rest waits for the next round
+        batch.clear ();
+        size_t bytes = 0;
+        while (!model->queue.empty ())
+          {
+            size_t request_bytes = model->queue.front ()->n * model->D * sizeof (float);
+            if (!batch.empty () && bytes + request_bytes > PROJECTION_SERVER_MAX_BYTES)
+              break;
+            bytes += request_bytes;
+            batch.push_back (model->queue.front ());
+            model->queue.pop_front ();
+          }
+      }
+
+      n = 0;
+      for (i = 0; i < batch.size (); i++)
+        n += batch[i]->n;
+      in.resize (n * model->D);
+      out.resize (n * model->L);
+      n = 0;
+      for (i = 0; i < batch.size (); i++)
+        {
+          memcpy (&in[n * model->D], batch[i]->data, batch[i]->n * model->D * sizeof (float));
+          n += batch[i]->n;
+        }
+
+      project (in.data (), out.data (), model->pca, model->mean, model->scale, n, model->D, model->L, true);
+
+      {
+        std::lock_guard<std::mutex> guard (model->lock);
+        n = 0;
+        for (i = 0; i < batch.size (); i++)
+          {
+            memcpy (batch[i]->out, &out[n * model->L], batch[i]->n * model->L * sizeof (float));
+            n += batch[i]->n;
+            batch[i]->done = true;
+          }
+      }
+      model->finished.notify_all ();
+    }
+}
+
+inline void projection_connection (
+    projection_model *model,
+    int fd)
+{
+  uint32_t header[2];
+  std::vector<float> data, out;
+  while (recv_all (fd, header, sizeof (header)))
+    {
+      size_t width = std::max (model->D, model->L);
+      if (header[1] != model->D || (size_t) header[0] * width * sizeof (float) > PROJECTION_SERVER_MAX_BYTES)
+        {
+          break;
+        }
+      // An exception would terminate the daemon from this detached thread
+      try
+        {
+          data.resize ((size_t) header[0] * model->D);
+          out.resize ((size_t) header[0] * model->L);
+        }
+      catch (std::bad_alloc &e)
+        {
+          break;
+        }
+      if (!recv_all (fd, data.data (), data.size () * sizeof (float)))
+        {
+          break;
+        }
+
+      if (header[0] > 0)
+        {
+          projection_request request;
+          request.data = data.data ();
+          request.out = out.data ();
+          request.n = header[0];
+          request.done = false;
+          std::unique_lock<std::mutex> guard (model->lock);
+          model->queue.push_back (&request);
+          model->pending.notify_one ();
+          while (!request.done)
+            model->finished.wait (guard);
+        }
+
+      header[1] = model->L;
+      if (!send_all (fd, header, sizeof (header))
+          || !send_all (fd, out.data (), out.size () * sizeof (float)))
+        {
+          break;
+        }
+    }
+  close (fd);
+}
+
+// Listens on the Unix socket socket_path and serves projections until the process is killed.
+inline bool run_projection_server (
+    const std::string &socket_path,
+    const float *pca,
+    const float *mean,
+    const float *scale,
+    size_t D,
+    size_t L)
+{
+  struct sockaddr_un addr;
+  if (socket_path.size () >= sizeof (addr.sun_path))
+    {
+      return false;
+    }
+  int server_fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (server_fd < 0)
+    {
+      return false;
+    }
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strncpy (addr.sun_path, socket_path.c_str (), sizeof (addr.sun_path) - 1);
+  unlink (socket_path.c_str ());
+  if (bind (server_fd, (struct sockaddr *) &addr, sizeof (addr)) != 0
+      || listen (server_fd, 64) != 0)
+    {
+      close (server_fd);
+      return false;
+    }
+
+  projection_model *model = new projection_model ();
+  model->pca = pca;
+  model->mean = mean;
+  model->scale = scale;
+  model->D = D;
+  model->L = L;
+
+  // Warm up the BLAS/OpenMP thread pools before the first query
+  std::vector<float> in (D, 1.0f), out (L);
+  project (in.data (), out.data (), pca, mean, scale, 1, D, L, true);
+
+  std::thread (projection_worker, model).detach ();
+  while (true)
+    {
+      int fd = accept (server_fd, nullptr, nullptr);
+      if (fd < 0)
+        {
+          if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+          // Out of descriptors or memory: retrying at once would spin, wait for connections to close
+          std::cerr << "accept: " << strerror (errno) << std::endl;
+          std::this_thread::sleep_for (std::chrono::milliseconds (100));
+          continue;
+        }
+      std::thread (projection_connection, model, fd).detach ();
+    }
+
+  close (server_fd);
+  return true;
+}
+
+#endif //EVALUATION_DEEPLOCALDESC_SERVER_HPP
@@ -0,0 +1,75 @@
+/*
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVALUATION_DEEPLOCALDESC_THREADS_HPP
+#define EVALUATION_DEEPLOCALDESC_THREADS_HPP
+
+#include <cblas.h>
+#include <sched.h>
+#include <vector>
+#include <unistd.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Set the number of OpenMP and OpenBLAS threads. Values <= 0 keep the defaults.
+inline void set_num_threads (
+    int omp_threads,
+    int blas_threads)
+{
+#ifdef _OPENMP
+  if (omp_threads > 0)
+    omp_set_num_threads (omp_threads);
+#endif
+  if (blas_threads > 0)
+    openblas_set_num_threads (blas_threads);
+}
+
+// Pin the i-th OpenMP thread to the i-th CPU the process may run on (see sched_getaffinity, so
+// taskset and cgroup limits are honoured). The OpenMP runtime keeps its thread pool between
+// parallel regions, so the rows of a static schedule stay on the same core, and on the same NUMA
+// node as the pages it touched first. Thread 0 is the calling thread: threads it creates later
+// inherit its new single-CPU mask. Returns false if a thread could not be pinned.
+inline bool pin_threads ()
+{
+  bool ok = true;
+#if defined(_OPENMP) && defined(__linux__)
+  cpu_set_t allowed;
+  if (sched_getaffinity (0, sizeof (allowed), &allowed) != 0)
+    {
+      return false;
+    }
+  std::vector<int> cpus;
+  int cpu;
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    if (CPU_ISSET (cpu, &allowed))
+      cpus.push_back (cpu);
+  if (cpus.empty ())
+    {
+      return false;
+    }
+#pragma omp parallel reduction(&&:ok)
+  {
+    cpu_set_t set;
+    CPU_ZERO (&set);
+    CPU_SET (cpus[omp_get_thread_num () % cpus.size ()], &set);
+    ok = sched_setaffinity (0, sizeof (set), &set) == 0;
+  }
+#endif
+  return ok;
+}
+
+#endif //EVALUATION_DEEPLOCALDESC_THREADS_HPP
@@ -0,0 +1,231 @@
+/*
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVALUATION_DEEPLOCALDESC_VERIFY_HPP
+#define EVALUATION_DEEPLOCALDESC_VERIFY_HPP
+
+#include <pca.hpp>
+#include <kernels.hpp>
+#include <extract_patches.hpp>
+#include <opencv2/calib3d.hpp>
+#include <fstream>
+#include <sstream>
+#include <cfloat>
+
+// Spatial verification: the local descriptors of a query and of a candidate image are matched
+// with the ratio test, then RANSAC fits an affine transform or a homography to the keypoints of
+// the matches. Candidates are re-ranked by their number of inliers.
+
+#define VERIFY_RATIO 0.8f
+#define VERIFY_THRESHOLD 8.0f // RANSAC reprojection threshold, in pixels
+#define VERIFY_MIN_INLIERS 8
+
+struct image_features
+{
+  std::vector<float> descriptors; // n x D
+  std::vector<cv::Point2f> points; // keypoint of each descriptor
+};
+
+// Loads the descriptors of an image (n x D floats) and its keypoints.fvecs from extract_patches
+inline bool load_image_features (
+    const std::string &descriptor_file,
+    const std::string &keypoint_file,
+    size_t D,
+    image_features &features)
+{
+  float *data, *values;
+  int *id;
+  size_t i;
+  size_t n = load_data (descriptor_file, data, id, 0, D);
+  if (n == (size_t) -1)
+    {
+      return false;
+    }
+  ::delete id;
+  size_t m = load_data (keypoint_file, values, id, 0, KEYPOINT_FIELDS);
+  if (m != n)
+    {
+      ::delete data;
+      return false;
+    }
+  ::delete id;
+
+  features.descriptors.assign (data, data + n * D);
+  features.points.resize (n);
+  for (i = 0; i < n; i++)
+    features.points[i] = cv::Point2f (values[i * KEYPOINT_FIELDS], values[i * KEYPOINT_FIELDS + 1]);
+  ::delete data;
+  ::delete values;
+  return true;
+}
+
+// Each line of a list file names the descriptor file and the keypoint file of one image
+inline bool load_image_list (
+    const std::string &list_file,
+    std::vector<std::pair<std::string, std::string> > &images)
+{
+  std::ifstream in (list_file.c_str ());
+  if (!in)
+    {
+      return false;
+    }
+  std::string line, descriptor_file, keypoint_file;
+  while (std::getline (in, line))
+    {
+      std::istringstream fields (line);
+      if (fields >> descriptor_file >> keypoint_file)
+        images.push_back (std::make_pair (descriptor_file, keypoint_file));
+    }
+  return true;
+}
+
+// Tentative correspondences: the nearest neighbour of each query descriptor in the
+// candidate, kept if it is clearly closer than the second nearest one.
+inline void match_descriptors (
+    const image_features &query,
+    const image_features &candidate,
+    size_t D,
+    distance_fn distance,
+    std::vector<cv::Point2f> &src,
+    std::vector<cv::Point2f> &dst)
+{
+  size_t i, j;
+  size_t nq = query.points.size (), nc = candidate.points.size ();
+  const float ratio = VERIFY_RATIO * VERIFY_RATIO; // distances are squared
+  src.clear ();
+  dst.clear ();
+  if (nc < 2)
+    {
+      return;
+    }
+  for (i = 0; i < nq; i++)
+    {
+      const float *q = &query.descriptors[i * D];
+      float best = FLT_MAX, second = FLT_MAX;
+      size_t best_j = 0;
+      for (j = 0; j < nc; j++)
+        {
+          float d = distance (q, &candidate.descriptors[j * D], D);
+          if (d < best)
+            {
+              second = best;
+              best = d;
+              best_j = j;
+            }
+          else if (d < second)
+            {
+              second = d;
+            }
+        }
+      if (best < ratio * second)
+        {
+          src.push_back (query.points[i]);
+          dst.push_back (candidate.points[best_j]);
+        }
+    }
+}
+
+// Number of RANSAC inliers of the best affine transform (or homography) between the matches
+inline int verify_matches (
+    const std::vector<cv::Point2f> &src,
+    const std::vector<cv::Point2f> &dst,
+    bool homography)
+{
+  size_t min_matches = homography ? 4 : 3;
+  if (src.size () < min_matches)
+    {
+      return 0;
+    }
+  std::vector<unsigned char> mask;
+  try
+    {
+      cv::Mat model;
+      if (homography)
+        model = cv::findHomography (src, dst, cv::RANSAC, VERIFY_THRESHOLD, mask);
+      else
+        model = cv::estimateAffine2D (src, dst, mask, cv::RANSAC, VERIFY_THRESHOLD);
+      if (model.empty ())
+        {
+          return 0;
+        }
+    }
+  catch (cv::Exception &e)
+    {
+      return 0;
+    }
+  return std::count (mask.begin (), mask.end (), 1);
+}
+
+// Re-ranks the R candidates of each query (shortlist: nq x R database indices, -1 for none).
+// ranked receives the candidates sorted by decreasing number of inliers, inliers their counts.
+// All (query, candidate) pairs are verified in parallel. A pair with fewer tentative matches
+// than min_inliers cannot reach the threshold, so RANSAC is skipped for it.
+inline void rerank (
+    const std::vector<image_features> &queries,
+    const std::vector<image_features> &database,
+    const int *shortlist,
+    int *ranked,
+    int *inliers,
+    size_t R,
+    size_t D,
+    bool homography,
+    size_t min_inliers)
+{
+  size_t nq = queries.size ();
+  long p;
+  distance_fn distance = select_squared_l2 (D);
+  std::vector<int> score (nq * R, 0);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+  for (p = 0; p < (long) (nq * R); p++)
+    {
+      int c = shortlist[p];
+      if (c < 0 || c >= (int) database.size ())
+        {
+          continue;
+        }
+      std::vector<cv::Point2f> src, dst;
+      match_descriptors (queries[p / R], database[c], D, distance, src, dst);
+      if (src.size () < min_inliers)
+        {
+          continue;
+        }
+      int count = verify_matches (src, dst, homography);
+      score[p] = count >= (int) min_inliers ? count : 0;
+    }
+
+  size_t q, j;
+  for (q = 0; q < nq; q++)
+    {
+      // Verified candidates first; the original order is kept between equal scores
+      std::vector<size_t> order (R);
+      for (j = 0; j < R; j++)
+        order[j] = j;
+      const int *s = &score[q * R];
+      std::stable_sort (order.begin (), order.end (), [s] (size_t a, size_t b)
+      {
+        return s[a] > s[b];
+      });
+      for (j = 0; j < R; j++)
+        {
+          ranked[q * R + j] = shortlist[q * R + order[j]];
+          inliers[q * R + j] = s[order[j]];
+        }
+    }
+}
+
+#endif //EVALUATION_DEEPLOCALDESC_VERIFY_HPP